@@ -35,6 +35,7 @@ struct CommandResult {
   std::string message;
   std::string user = "";
   int n = 0;
+  std::string after = "";
 };
 
 template <typename Storage>
@@ -130,11 +131,32 @@ inline CommandResult handle_lobby_command(const std::string &line,
     return {true, "logout"};
   } else if (cmd == "LIST") {
 
+    if (parts.size() > 3) {
+      return {false, "ERROR Usage: LIST [<prefix>|* [<after-login>]]\n"};
+    }
+
+    if (parts.size() == 1) {
+      return {true, "list"};
+    }
+
+    std::string prefix = parts[1] == "*" ? "" : parts[1];
+    std::string after = parts.size() == 3 ? parts[2] : "";
+
+    return {true, "list_page", prefix, 0, after};
+  } else if (cmd == "WATCH") {
+
+    if (parts.size() != 1) {
+      return {false, "ERROR Usage: WATCH\n"};
+    }
+
+    return {true, "watch"};
+  } else if (cmd == "UNWATCH") {
+
     if (parts.size() != 1) {
-      return {false, "ERROR Usage: LIST\n"};
+      return {false, "ERROR Usage: UNWATCH\n"};
     }
 
-    return {true, "list"};
+    return {true, "unwatch"};
   }
   return {false, "ERROR Unknown command\n"};
 }
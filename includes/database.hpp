@@ -1,7 +1,9 @@
 #pragma once
 
 #include <ctime>
+#include <sqlite3.h>
 #include <sqlite_orm/sqlite_orm.h>
+#include <stdexcept>
 #include <string>
 
 struct User {
@@ -19,10 +21,43 @@ struct Message {
   bool delivered;
 };
 
-inline auto &initStorage(const std::string &dbPath = "users.db") {
+static constexpr int DB_BUSY_TIMEOUT_MS = 5000;
+
+// Each entry moves the schema from version i to i + 1. Steps are frozen once
+// released; change the schema by appending a step, then update the mapping
+// in makeStorage() to match.
+static constexpr const char *SCHEMA_MIGRATIONS[] = {
+    // 1: baseline tables plus the unread lookup index.
+    R"sql(
+      CREATE TABLE IF NOT EXISTS "users" (
+        "id" INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
+        "login" TEXT UNIQUE NOT NULL,
+        "passhash" TEXT NOT NULL);
+      CREATE TABLE IF NOT EXISTS "messages" (
+        "id" INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
+        "sender_id" INTEGER NOT NULL,
+        "receiver_id" INTEGER NOT NULL,
+        "body" TEXT NOT NULL,
+        "ts" INTEGER NOT NULL,
+        "delivered" INTEGER DEFAULT (0) NOT NULL,
+        FOREIGN KEY("sender_id") REFERENCES "users"("id"),
+        FOREIGN KEY("receiver_id") REFERENCES "users"("id"));
+      CREATE INDEX IF NOT EXISTS "idx_messages_receiver_delivered"
+        ON "messages" ("receiver_id", "delivered");
+    )sql",
+    // 2: recent-message scans used by the cache warm-up.
+    R"sql(
+      CREATE INDEX IF NOT EXISTS "idx_messages_ts" ON "messages" ("ts");
+    )sql",
+};
+
+static constexpr int SCHEMA_VERSION =
+    sizeof(SCHEMA_MIGRATIONS) / sizeof(SCHEMA_MIGRATIONS[0]);
+
+inline auto makeStorage(const std::string &dbPath) {
   using namespace sqlite_orm;
 
-  static auto storage = make_storage(
+  return make_storage(
       dbPath,
       make_table("users",
                  make_column("id", &User::id, primary_key().autoincrement()),
@@ -39,7 +74,64 @@ inline auto &initStorage(const std::string &dbPath = "users.db") {
 
           foreign_key(&Message::sender_id).references(&User::id),
           foreign_key(&Message::receiver_id).references(&User::id)));
+}
 
-  storage.sync_schema();
+inline auto &initStorage(const std::string &dbPath = "users.db") {
+  static auto storage = makeStorage(dbPath);
   return storage;
+}
+
+// Keeps one connection open with a busy timeout, so a writer waits out a
+// concurrent reader instead of failing with SQLITE_BUSY.
+template <typename Storage> inline void openStorage(Storage &storage) {
+  storage.on_open = [](sqlite3 *handle) {
+    sqlite3_busy_timeout(handle, DB_BUSY_TIMEOUT_MS);
+  };
+  storage.open_forever();
+}
+
+// Brings the file up to SCHEMA_VERSION on a short-lived connection of its
+// own. An up-to-date database costs a single PRAGMA user_version read.
+inline void migrateStorage(const std::string &dbPath) {
+  sqlite3 *handle = nullptr;
+  auto fail = [&](const std::string &what) {
+    std::string msg = "schema migration: " + what + ": " +
+                      (handle ? sqlite3_errmsg(handle) : "out of memory");
+    sqlite3_close(handle);
+    throw std::runtime_error(msg);
+  };
+  auto exec = [&](const std::string &sql, const std::string &what) {
+    if (sqlite3_exec(handle, sql.c_str(), nullptr, nullptr, nullptr) !=
+        SQLITE_OK)
+      fail(what);
+  };
+
+  if (sqlite3_open(dbPath.c_str(), &handle) != SQLITE_OK)
+    fail("open " + dbPath);
+  sqlite3_busy_timeout(handle, DB_BUSY_TIMEOUT_MS);
+
+  int version = 0;
+  sqlite3_stmt *stmt = nullptr;
+  if (sqlite3_prepare_v2(handle, "PRAGMA user_version", -1, &stmt, nullptr) !=
+      SQLITE_OK)
+    fail("PRAGMA user_version");
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    version = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  if (version < SCHEMA_VERSION) {
+    // WAL lets the io thread write while the warm-up thread is reading. The
+    // mode is stored in the file, so it only needs setting while migrating.
+    exec("PRAGMA journal_mode=WAL", "enable WAL");
+  }
+
+  for (; version < SCHEMA_VERSION; ++version) {
+    std::string step = "step " + std::to_string(version + 1);
+    exec("BEGIN IMMEDIATE", step);
+    exec(SCHEMA_MIGRATIONS[version], step);
+    exec("PRAGMA user_version = " + std::to_string(version + 1), step);
+    exec("COMMIT", step);
+  }
+
+  sqlite3_close(handle);
 }
\ No newline at end of file
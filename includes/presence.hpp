@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+static constexpr std::size_t LIST_PAGE_SIZE = 50;
+// Writes a watcher may have pending before it is dropped and told to resync.
+static constexpr std::size_t PRESENCE_MAX_BACKLOG = 256;
+
+// Ordered set of online logins. Every join/leave bumps the version and is
+// pushed as a delta to subscribers only; the full listing is rebuilt lazily,
+// at most once per version.
+template <typename Subscriber> class presence {
+public:
+  using subscriber_ptr = std::shared_ptr<Subscriber>;
+
+  bool join(const std::string &login) {
+    if (!online.insert(login).second)
+      return false;
+    publish("JOIN", login);
+    return true;
+  }
+
+  bool leave(const std::string &login) {
+    if (online.erase(login) == 0)
+      return false;
+    publish("LEAVE", login);
+    return true;
+  }
+
+  // Keyed by session, so two sessions of one login watch independently.
+  void subscribe(const std::string &login, const subscriber_ptr &s) {
+    subscribers[s.get()] = {login, s};
+  }
+
+  void unsubscribe(const subscriber_ptr &s) { subscribers.erase(s.get()); }
+
+  std::uint64_t version() const { return ver; }
+
+  // " alice bob ..." for everyone online, cached until the next change.
+  const std::string &snapshot() {
+    if (cached_ver != ver) {
+      std::size_t len = 0;
+      for (auto &&login : online)
+        len += login.size() + 1;
+
+      cache.clear();
+      cache.reserve(len);
+      for (auto &&login : online) {
+        cache += ' ';
+        cache += login;
+      }
+      cached_ver = ver;
+    }
+    return cache;
+  }
+
+  // Up to `page_size` logins starting with `prefix` that sort after `after`,
+  // skipping `self`, in the snapshot format. The last login of a page is the
+  // cursor for the next one, so any page costs O(log N + page_size).
+  std::string page(const std::string &prefix, const std::string &after,
+                   const std::string &self,
+                   std::size_t page_size = LIST_PAGE_SIZE) const {
+    auto it = after < prefix ? online.lower_bound(prefix)
+                             : online.upper_bound(after);
+    auto next = [&] {
+      while (it != online.end() && *it == self)
+        ++it;
+      return it != online.end() && it->compare(0, prefix.size(), prefix) == 0;
+    };
+
+    std::string out;
+    for (std::size_t i = 0; i < page_size && next(); ++i, ++it) {
+      out += ' ';
+      out += *it;
+    }
+    return out;
+  }
+
+private:
+  void publish(const char *event, const std::string &login) {
+    ++ver;
+    if (subscribers.empty())
+      return;
+
+    std::string delta = "PRESENCE " + std::to_string(ver) + ' ' + event + ' ' +
+                        login + "\r\n";
+    for (auto it = subscribers.begin(); it != subscribers.end();) {
+      auto s = it->second.session.lock();
+      if (!s) {
+        it = subscribers.erase(it);
+      } else if (s->backlog() >= PRESENCE_MAX_BACKLOG) {
+        // A watcher that stopped reading gets one final line and no more;
+        // it can recover with LIST followed by WATCH.
+        s->post("PRESENCE " + std::to_string(ver) + " RESET\r\n");
+        it = subscribers.erase(it);
+      } else {
+        if (it->second.login != login)
+          s->post(delta);
+        ++it;
+      }
+    }
+  }
+
+  struct subscriber {
+    std::string login;
+    std::weak_ptr<Subscriber> session;
+  };
+
+  std::set<std::string> online;
+  std::unordered_map<const Subscriber *, subscriber> subscribers;
+  std::uint64_t ver = 0;
+  std::uint64_t cached_ver = ~std::uint64_t{0};
+  std::string cache;
+};
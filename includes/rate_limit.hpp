@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+enum class rate_class { none, auth, chat, list };
+
+struct rate_policy {
+  float rate;  // tokens per second
+  float burst; // bucket capacity
+};
+
+// LOGIN/REGISTER run Argon2, so they get the tightest budget.
+static constexpr rate_policy AUTH_POLICY{0.2f, 5.f};
+static constexpr rate_policy CHAT_POLICY{5.f, 20.f};
+static constexpr rate_policy LIST_POLICY{1.f, 5.f};
+
+class token_bucket_table {
+public:
+  using clock = std::chrono::steady_clock;
+
+  explicit token_bucket_table(rate_policy policy) : policy(policy) {}
+
+  // Time until `key` holds a whole token; zero if it already does.
+  clock::duration wait_for(const std::string &key, clock::time_point now) {
+    auto &b = refill(key, now);
+    if (b.tokens >= 1.f)
+      return clock::duration::zero();
+
+    std::chrono::duration<float> missing((1.f - b.tokens) / policy.rate);
+    return std::chrono::duration_cast<clock::duration>(missing) +
+           clock::duration(1);
+  }
+
+  void take(const std::string &key) { buckets[key].tokens -= 1.f; }
+
+  // A bucket that has refilled to capacity is indistinguishable from a
+  // fresh one, so it can be dropped.
+  std::size_t expire(clock::time_point now) {
+    std::size_t removed = 0;
+    for (auto it = buckets.begin(); it != buckets.end();) {
+      if (level(it->second, now) >= policy.burst) {
+        it = buckets.erase(it);
+        ++removed;
+      } else {
+        ++it;
+      }
+    }
+    return removed;
+  }
+
+  std::size_t size() const { return buckets.size(); }
+
+private:
+  struct bucket {
+    float tokens;
+    clock::time_point stamp;
+  };
+
+  float level(const bucket &b, clock::time_point now) const {
+    std::chrono::duration<float> elapsed = now - b.stamp;
+    return std::min(policy.burst, b.tokens + elapsed.count() * policy.rate);
+  }
+
+  bucket &refill(const std::string &key, clock::time_point now) {
+    auto [it, inserted] = buckets.try_emplace(key, bucket{policy.burst, now});
+    if (!inserted) {
+      it->second.tokens = level(it->second, now);
+      it->second.stamp = now;
+    }
+    return it->second;
+  }
+
+  rate_policy policy;
+  std::unordered_map<std::string, bucket> buckets;
+};
+
+class rate_limiter {
+public:
+  using clock = token_bucket_table::clock;
+
+  rate_limiter()
+      : tables{token_bucket_table{AUTH_POLICY}, token_bucket_table{CHAT_POLICY},
+               token_bucket_table{LIST_POLICY}} {}
+
+  // Charges one token to the remote address and, if given, the user.
+  // Nothing is charged unless both buckets can pay; otherwise returns how
+  // long the caller should hold off before trying again.
+  clock::duration acquire(rate_class cls, const std::string &ip,
+                          const std::string &user,
+                          clock::time_point now = clock::now()) {
+    if (cls == rate_class::none)
+      return clock::duration::zero();
+
+    auto &table = tables[static_cast<std::size_t>(cls) - 1];
+    std::string ip_key = "ip:" + ip;
+
+    auto wait = table.wait_for(ip_key, now);
+    if (wait > clock::duration::zero())
+      return wait;
+
+    if (!user.empty()) {
+      std::string user_key = "u:" + user;
+      wait = table.wait_for(user_key, now);
+      if (wait > clock::duration::zero())
+        return wait;
+      table.take(user_key);
+    }
+
+    table.take(ip_key);
+    return clock::duration::zero();
+  }
+
+  std::size_t expire(clock::time_point now = clock::now()) {
+    std::size_t removed = 0;
+    for (auto &t : tables)
+      removed += t.expire(now);
+    return removed;
+  }
+
+private:
+  std::array<token_bucket_table, 3> tables;
+};
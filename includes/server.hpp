@@ -1,6 +1,7 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <optional>
 #include <string>
 
 static constexpr auto WELCOME_MSG =
@@ -16,6 +17,9 @@ static constexpr auto LOBBY_MSG =
     "===========================================\r\n"
     "  CHAT  <login>   — start chat with user\r\n"
     "  LIST           — show online users\r\n"
+    "  LIST <p> [<l>] — users starting with p after login l (* for all)\r\n"
+    "  WATCH          — get notified when users come and go\r\n"
+    "  UNWATCH        — stop presence notifications\r\n"
     "  LOGOUT         — log out\r\n"
     "===========================================\r\n";
 
@@ -33,5 +37,11 @@ using error_handler = std::function<void()>;
 
 using add_online_user =
     std::function<void(std::string, std::shared_ptr<session>)>;
-using delete_online_user = std::function<void(std::string)>;
-using list_online_user = std::function<std::string(std::string)>;
\ No newline at end of file
+using delete_online_user =
+    std::function<void(std::string, std::shared_ptr<session>)>;
+// A prefix asks for one page after the given login instead of everyone.
+using list_online_user = std::function<std::string(
+    std::string, std::optional<std::string>, std::string)>;
+using watch_online_user =
+    std::function<void(std::string, std::shared_ptr<session>)>;
+using unwatch_online_user = std::function<void(std::shared_ptr<session>)>;
\ No newline at end of file
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <sqlite_orm/sqlite_orm.h>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "database.hpp"
+
+static constexpr int WARMUP_RECENT_MESSAGES = 10000;
+
+// login -> id and per-receiver undelivered counts. Owned by the io thread;
+// the warm-up thread fills a private copy and hands it over with merge().
+class user_cache {
+public:
+  std::optional<int> id(const std::string &login) const {
+    auto it = ids.find(login);
+    if (it == ids.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+  void remember(const std::string &login, int id) { ids[login] = id; }
+
+  std::optional<int> unread(int user_id) const {
+    auto it = unread_counts.find(user_id);
+    if (it == unread_counts.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+  void set_unread(int user_id, int n) { unread_counts[user_id] = n; }
+
+  // Adjusts a known counter; unknown ones are recounted on next use.
+  void add_unread(int user_id, int delta) {
+    auto it = unread_counts.find(user_id);
+    if (it != unread_counts.end())
+      it->second = std::max(0, it->second + delta);
+    else if (warming)
+      stale.insert(user_id);
+  }
+
+  void forget_unread(int user_id) {
+    unread_counts.erase(user_id);
+    if (warming)
+      stale.insert(user_id);
+  }
+
+  void begin_warmup() { warming = true; }
+  bool ready() const { return !warming; }
+
+  // Live traffic during warm-up is newer than the preloaded rows: existing
+  // entries win, and counters it touched are left to be recounted.
+  void merge(user_cache &&warm) {
+    ids.merge(warm.ids);
+    for (int user_id : stale)
+      warm.unread_counts.erase(user_id);
+    unread_counts.merge(warm.unread_counts);
+    stale.clear();
+    warming = false;
+  }
+
+  std::size_t users() const { return ids.size(); }
+  std::size_t counters() const { return unread_counts.size(); }
+
+private:
+  std::unordered_map<std::string, int> ids;
+  std::unordered_map<int, int> unread_counts;
+  std::unordered_set<int> stale;
+  bool warming = false;
+};
+
+template <typename Storage>
+inline int cached_user_id(Storage &storage, user_cache &cache,
+                          const std::string &login) {
+  using namespace sqlite_orm;
+  if (auto id = cache.id(login))
+    return *id;
+
+  auto rows = storage.select(&User::id, where(c(&User::login) == login));
+  if (rows.empty())
+    throw std::runtime_error("no such user");
+
+  cache.remember(login, rows.front());
+  return rows.front();
+}
+
+template <typename Storage>
+inline int cached_unread(Storage &storage, user_cache &cache, int user_id) {
+  using namespace sqlite_orm;
+  if (auto n = cache.unread(user_id))
+    return *n;
+
+  int n = storage.template count<Message>(
+      where(c(&Message::receiver_id) == user_id &&
+            c(&Message::delivered) == false));
+  cache.set_unread(user_id, n);
+  return n;
+}
+
+// Users seen in the most recent messages, and every non-zero unread counter.
+template <typename Storage> inline user_cache preload_cache(Storage &storage) {
+  using namespace sqlite_orm;
+  user_cache warm;
+
+  try {
+    auto recent = storage.select(
+        columns(&Message::sender_id, &Message::receiver_id),
+        order_by(&Message::ts).desc(), limit(WARMUP_RECENT_MESSAGES));
+
+    std::vector<int> ids;
+    ids.reserve(recent.size() * 2);
+    for (auto &&row : recent) {
+      ids.push_back(std::get<0>(row));
+      ids.push_back(std::get<1>(row));
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    if (!ids.empty()) {
+      for (auto &&row : storage.select(columns(&User::id, &User::login),
+                                       where(in(&User::id, ids)))) {
+        warm.remember(std::get<1>(row), std::get<0>(row));
+        warm.set_unread(std::get<0>(row), 0);
+      }
+    }
+
+    for (auto &&row : storage.select(
+             columns(&Message::receiver_id, count(&Message::id)),
+             where(c(&Message::delivered) == false),
+             group_by(&Message::receiver_id))) {
+      warm.set_unread(std::get<0>(row), std::get<1>(row));
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "[warmup] preload failed: " << e.what() << '\n';
+  }
+
+  return warm;
+}
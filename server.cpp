@@ -5,26 +5,40 @@
 #include <queue>
 #include <sqlite_orm/sqlite_orm.h>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
 #include "includes/commands.hpp"
 #include "includes/database.hpp"
+#include "includes/presence.hpp"
+#include "includes/rate_limit.hpp"
 #include "includes/server.hpp"
+#include "includes/user_cache.hpp"
 
 class session : public std::enable_shared_from_this<session> {
 public:
   template <typename Storage>
-  session(tcp::socket &&socket, Storage &storage)
-      : socket(std::move(socket)), db(storage) {}
+  session(tcp::socket &&socket, Storage &storage, user_cache &cache,
+          rate_limiter &limiter)
+      : socket(std::move(socket)), throttle(this->socket.get_executor()),
+        db(storage), cache(cache), limiter(limiter) {
+    error_code ec;
+    auto endpoint = this->socket.remote_endpoint(ec);
+    if (!ec)
+      remote_ip = endpoint.address().to_string();
+  }
 
   void start(message_handler &&on_message, add_online_user &&on_add,
              delete_online_user &&on_delete, list_online_user &&on_list,
+             watch_online_user &&on_watch, unwatch_online_user &&on_unwatch,
              error_handler &&on_error) {
     this->on_message = std::move(on_message);
     this->on_add = std::move(on_add);
     this->on_delete = std::move(on_delete);
     this->on_list = std::move(on_list);
+    this->on_watch = std::move(on_watch);
+    this->on_unwatch = std::move(on_unwatch);
     this->on_error = std::move(on_error);
     async_read();
   }
@@ -39,6 +53,15 @@ public:
     }
   }
 
+  // The status line tells clients whether the cache warm-up has finished.
+  void welcome() {
+    post(WELCOME_MSG);
+    post(cache.ready() ? "Server: status ready\r\n"
+                       : "Server: status warming up\r\n");
+  }
+
+  std::size_t backlog() const { return outgoing.size(); }
+
   bool chatting_with(const std::string &login) const {
     return current_peer && *current_peer == login;
   }
@@ -46,56 +69,67 @@ public:
 private:
   void deliver_undelivered_messages() {
     using namespace sqlite_orm;
-    int sender_id =
-        *db.select(&User::id, where(c(&User::login) == *current_peer)).begin();
-    int receiver_id =
-        *db.select(&User::id, where(c(&User::login) == *current_user)).begin();
-
-    auto undelivered =
-        db.get_all<Message>(where(c(&Message::sender_id) == sender_id &&
-                                  c(&Message::receiver_id) == receiver_id &&
-                                  c(&Message::delivered) == false),
-                            order_by(&Message::ts));
-
-    for (auto &msg : undelivered) {
-      std::time_t ts = msg.ts;
-      char buf[20];
-      std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", std::localtime(&ts));
-      std::string current_time(buf);
-
-      post("[" + current_time + "] " + *current_peer + ": " + msg.body +
-           "\r\n");
-
-      msg.delivered = true;
-      db.update(msg);
+    try {
+      int sender_id = cached_user_id(db, cache, *current_peer);
+      int receiver_id = cached_user_id(db, cache, *current_user);
+
+      auto undelivered =
+          db.get_all<Message>(where(c(&Message::sender_id) == sender_id &&
+                                    c(&Message::receiver_id) == receiver_id &&
+                                    c(&Message::delivered) == false),
+                              order_by(&Message::ts));
+
+      for (auto &msg : undelivered) {
+        std::time_t ts = msg.ts;
+        char buf[20];
+        std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S",
+                      std::localtime(&ts));
+        std::string current_time(buf);
+
+        post("[" + current_time + "] " + *current_peer + ": " + msg.body +
+             "\r\n");
+
+        msg.delivered = true;
+        db.update(msg);
+        cache.add_unread(receiver_id, -1);
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "[DB] cannot deliver messages: " << e.what() << '\n';
     }
   }
 
   void deliver_history_messages(int n) {
     using namespace sqlite_orm;
-    int sender_id =
-        *db.select(&User::id, where(c(&User::login) == *current_peer)).begin();
-    int receiver_id =
-        *db.select(&User::id, where(c(&User::login) == *current_user)).begin();
-
-    auto history =
-        db.get_all<Message>(where(c(&Message::sender_id) == sender_id &&
-                                      c(&Message::receiver_id) == receiver_id ||
-                                  c(&Message::sender_id) == receiver_id &&
-                                      c(&Message::receiver_id) == sender_id),
-                            order_by(&Message::ts), limit(n));
-
-    for (auto &msg : history) {
-      std::time_t ts = msg.ts;
-      char buf[20];
-      std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", std::localtime(&ts));
-      std::string current_time(buf);
-
-      post("[" + current_time + "] " + *current_peer + ": " + msg.body +
-           "\r\n");
-
-      msg.delivered = true;
-      db.update(msg);
+    try {
+      int sender_id = cached_user_id(db, cache, *current_peer);
+      int receiver_id = cached_user_id(db, cache, *current_user);
+
+      auto history = db.get_all<Message>(
+          where(c(&Message::sender_id) == sender_id &&
+                    c(&Message::receiver_id) == receiver_id ||
+                c(&Message::sender_id) == receiver_id &&
+                    c(&Message::receiver_id) == sender_id),
+          order_by(&Message::ts), limit(n));
+
+      // The history spans both directions, so both counters are recounted.
+      cache.forget_unread(sender_id);
+      cache.forget_unread(receiver_id);
+
+      for (auto &msg : history) {
+        std::time_t ts = msg.ts;
+        char buf[20];
+        std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S",
+                      std::localtime(&ts));
+        std::string current_time(buf);
+
+        post("[" + current_time + "] " + *current_peer + ": " + msg.body +
+             "\r\n");
+
+        msg.delivered = true;
+        db.update(msg);
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "[DB] cannot deliver history: " << e.what() << '\n';
     }
   }
 
@@ -122,63 +156,115 @@ private:
       std::string line(begin, begin + bytes_transferred - 1);
       streambuf.consume(bytes_transferred);
 
-      if (!is_logged_in()) {
-        auto res = handle_auth_command(line, db);
-        post("Server: " + res.message);
-        if (res.success) {
-          current_user = res.user;
-          post(LOBBY_MSG);
+      throttled_handle(std::move(line));
+    } else {
+      disconnect(error);
+    }
+  }
 
-          on_add(*current_user, shared_from_this());
-        }
-      } else {
-        if (in_chat()) {
-          auto res = handle_chat_command(line);
-          if (!res.success) {
-            post("Server: " + res.message);
+  rate_class classify(const std::string &line, std::string &user) const {
+    std::vector<std::string> parts;
+    boost::split(parts, line, boost::is_any_of(" "), boost::token_compress_on);
+
+    // The login named in LOGIN/REGISTER is unproven, so keying a bucket on
+    // it would let anyone lock a victim out. Auth is limited per address.
+    if (!is_logged_in())
+      return rate_class::auth;
+
+    user = *current_user;
+    const auto &cmd = parts[0];
+    if (in_chat()) {
+      if (cmd == "/history")
+        return rate_class::list;
+      if (cmd == "/exit" || cmd == "/who")
+        return rate_class::none;
+      return rate_class::chat;
+    }
+    if (cmd == "LIST" || cmd == "CHAT")
+      return rate_class::list;
+    return rate_class::none;
+  }
+
+  // Over-budget lines are held here with no read outstanding, so a flooding
+  // client is pushed back by TCP instead of by a growing backlog.
+  void throttled_handle(std::string line) {
+    std::string user;
+    auto cls = classify(line, user);
+    auto wait = limiter.acquire(cls, remote_ip, user);
+
+    if (wait > rate_limiter::clock::duration::zero()) {
+      throttle.expires_after(wait);
+      throttle.async_wait([self = shared_from_this(),
+                           line = std::move(line)](error_code error) {
+        // A line parked across a disconnect must not run on the dead session.
+        if (!error && self->socket.is_open())
+          self->throttled_handle(std::move(line));
+      });
+      return;
+    }
+
+    handle_line(line);
+    async_read();
+  }
+
+  void handle_line(const std::string &line) {
+    if (!is_logged_in()) {
+      auto res = handle_auth_command(line, db);
+      post("Server: " + res.message);
+      if (res.success) {
+        current_user = res.user;
+        post(LOBBY_MSG);
+
+        on_add(*current_user, shared_from_this());
+      }
+    } else {
+      if (in_chat()) {
+        auto res = handle_chat_command(line);
+        if (!res.success) {
+          post("Server: " + res.message);
+        } else {
+          if (res.message == "exit") {
+            current_peer.reset();
+            post("\033[2J\033[H\n");
+            post(LOBBY_MSG);
+          } else if (res.message == "who") {
+            post("Chat with " + current_peer.value() + "\r\n");
+          } else if (res.message == "history") {
+            chat_message();
+            deliver_history_messages(res.n);
           } else {
-            if (res.message == "exit") {
-              current_peer.reset();
-              post("\033[2J\033[H\n");
-              post(LOBBY_MSG);
-            } else if (res.message == "who") {
-              post("Chat with " + current_peer.value() + "\r\n");
-            } else if (res.message == "history") {
-              chat_message();
-              deliver_history_messages(res.n);
-            } else {
-              on_message(res.message, *current_user, *current_peer);
-            }
+            on_message(res.message, *current_user, *current_peer);
           }
+        }
 
+      } else {
+        auto res = handle_lobby_command(line, db);
+        if (!res.success) {
+          post("Server: " + res.message);
         } else {
-          auto res = handle_lobby_command(line, db);
-          if (!res.success) {
-            post("Server: " + res.message);
-          } else {
-            if (res.message == "logout") {
-              on_delete(*current_user);
-
-              post("\033[2J\033[H\n");
-              post(WELCOME_MSG);
-
-              current_peer.reset();
-              current_user.reset();
-            } else if (res.message == "chat") {
-              current_peer = res.user;
-              chat_message();
-              deliver_undelivered_messages();
-            } else if (res.message == "list") {
-              post(on_list(*current_user));
-            }
+          if (res.message == "logout") {
+            on_delete(*current_user, shared_from_this());
+
+            post("\033[2J\033[H\n");
+            welcome();
+
+            current_peer.reset();
+            current_user.reset();
+          } else if (res.message == "chat") {
+            current_peer = res.user;
+            chat_message();
+            deliver_undelivered_messages();
+          } else if (res.message == "list") {
+            post(on_list(*current_user, std::nullopt, ""));
+          } else if (res.message == "list_page") {
+            post(on_list(*current_user, res.user, res.after));
+          } else if (res.message == "watch") {
+            on_watch(*current_user, shared_from_this());
+          } else if (res.message == "unwatch") {
+            on_unwatch(shared_from_this());
           }
         }
       }
-
-      async_read();
-    } else {
-      socket.close(error);
-      on_error();
     }
   }
 
@@ -195,16 +281,30 @@ private:
         async_write();
       }
     } else {
-      socket.close(error);
-      on_error();
+      disconnect(error);
+    }
+  }
+
+  void disconnect(error_code error) {
+    socket.close(error);
+    throttle.cancel();
+    if (is_logged_in()) {
+      on_delete(*current_user, shared_from_this());
+      current_user.reset();
+      current_peer.reset();
     }
+    on_error();
   }
 
   bool is_logged_in() const { return current_user.has_value(); }
   bool in_chat() const { return current_peer.has_value(); }
 
   tcp::socket socket;
+  io::steady_timer throttle;
   decltype(initStorage()) &db;
+  user_cache &cache;
+  rate_limiter &limiter;
+  std::string remote_ip;
 
   io::streambuf streambuf;
   std::queue<std::string> outgoing;
@@ -213,6 +313,8 @@ private:
   add_online_user on_add;
   delete_online_user on_delete;
   list_online_user on_list;
+  watch_online_user on_watch;
+  unwatch_online_user on_unwatch;
   error_handler on_error;
 
   std::optional<std::string> current_user;
@@ -226,14 +328,51 @@ public:
   template <typename Storage>
   server(io::io_context &io_context, std::uint16_t port, Storage &storage)
       : io_context(io_context),
-        acceptor(io_context, tcp::endpoint(tcp::v4(), port)), db(storage) {}
+        acceptor(io_context, tcp::endpoint(tcp::v4(), port)),
+        expiry_timer(io_context), db(storage) {
+    schedule_expiry();
+  }
+
+  ~server() {
+    if (warmup.joinable())
+      warmup.join();
+  }
+
+  // Preloads the cache on a separate connection while the io thread is
+  // already accepting; results are merged back on the io thread.
+  void warm_up(const std::string &dbPath) {
+    cache.begin_warmup();
+    auto started = std::chrono::steady_clock::now();
+
+    warmup = std::thread([this, dbPath, started] {
+      // Nothing may escape this thread; an empty result still ends warm-up.
+      user_cache warm;
+      try {
+        auto storage = makeStorage(dbPath);
+        openStorage(storage);
+        warm = preload_cache(storage);
+      } catch (const std::exception &e) {
+        std::cerr << "[warmup] cannot open database: " << e.what() << '\n';
+      }
+
+      io::post(io_context, [this, warm = std::move(warm), started]() mutable {
+        cache.merge(std::move(warm));
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started);
+        std::cerr << "[warmup] ready in " << ms.count() << " ms: "
+                  << cache.users() << " users, " << cache.counters()
+                  << " unread counters\n";
+      });
+    });
+  }
 
   void async_accept() {
     socket.emplace(io_context);
 
     acceptor.async_accept(*socket, [&](error_code /* error */) {
-      auto client = std::make_shared<session>(std::move(*socket), db);
-      client->post(WELCOME_MSG);
+      auto client = std::make_shared<session>(std::move(*socket), db, cache,
+                                               limiter);
+      client->welcome();
 
       // post("We have a newcomer\n\r");
 
@@ -241,8 +380,10 @@ public:
 
       client->start(std::bind(&server::post, this, _1, _2, _3),
                     std::bind(&server::add_online, this, _1, _2),
-                    std::bind(&server::del_online, this, _1),
-                    std::bind(&server::list_online, this, _1),
+                    std::bind(&server::del_online, this, _1, _2),
+                    std::bind(&server::list_online, this, _1, _2, _3),
+                    std::bind(&server::watch_online, this, _1, _2),
+                    std::bind(&server::unwatch_online, this, _1),
                     [&, weak = std::weak_ptr(client)] {
                       if (auto shared = weak.lock();
                           shared && clients.erase(shared)) {
@@ -254,12 +395,8 @@ public:
     });
   }
 
-  int get_user_id(const std::string &login) const {
-    using namespace sqlite_orm;
-
-    auto rows = db.select(&User::id, where(c(&User::login) == login));
-    int id = *rows.begin();
-    return id;
+  int get_user_id(const std::string &login) {
+    return cached_user_id(db, cache, login);
   }
 
   void post(const std::string &message, const std::string &from_login,
@@ -280,8 +417,11 @@ public:
       }
 
       try {
-        db.insert(Message{0, get_user_id(from_login), get_user_id(to_login),
-                          message, ts, peer_in_chat});
+        int receiver_id = get_user_id(to_login);
+        db.insert(Message{0, get_user_id(from_login), receiver_id, message, ts,
+                          peer_in_chat});
+        if (!peer_in_chat)
+          cache.add_unread(receiver_id, 1);
       } catch (const std::exception &e) {
         std::cerr << "[DB] cannot insert message: " << e.what() << '\n';
       }
@@ -298,6 +438,7 @@ public:
       msg.delivered = false;
 
       db.insert(msg);
+      cache.add_unread(msg.receiver_id, 1);
     } catch (const std::exception &e) {
       std::cerr << "[DB] cannot insert message: " << e.what() << '\n';
     }
@@ -305,24 +446,86 @@ public:
 
   void add_online(const std::string &login, session_ptr s) {
     online[login] = s;
+    users.join(login);
+
+    try {
+      int n = cached_unread(db, cache, get_user_id(login));
+      if (n > 0)
+        s->post("Server: you have " + std::to_string(n) +
+                " unread messages\r\n");
+    } catch (const std::exception &e) {
+      std::cerr << "[DB] cannot count unread messages: " << e.what() << '\n';
+    }
   }
-  void del_online(const std::string &login) { online.erase(login); }
+  // A login may have several sessions; only the one routed to in `online`
+  // takes the login offline when it goes.
+  void del_online(const std::string &login, session_ptr s) {
+    users.unsubscribe(s);
 
-  std::string list_online(const std::string &login) const {
-    std::string out = "USERS:";
-    for (auto &&kv : online) {
-      if (kv.first != login)
-        out += ' ' + kv.first;
+    auto it = online.find(login);
+    if (it == online.end() || it->second != s)
+      return;
+    online.erase(it);
+    users.leave(login);
+  }
+
+  void watch_online(const std::string &login, session_ptr s) {
+    users.subscribe(login, s);
+    s->post("Server: OK watching presence at version " +
+            std::to_string(users.version()) + "\r\n");
+  }
+  void unwatch_online(session_ptr s) { users.unsubscribe(s); }
+
+  std::string list_online(const std::string &login,
+                          const std::optional<std::string> &prefix,
+                          const std::string &after) {
+    // The version lets a client line a listing up with PRESENCE deltas.
+    std::string header = "USERS " + std::to_string(users.version()) + ':';
+    if (prefix)
+      return header + users.page(*prefix, after, login) + "\r\n";
+
+    // Copy the cached listing around the caller's own entry.
+    const auto &all = users.snapshot();
+    std::string self = ' ' + login;
+    std::size_t pos = all.find(self);
+    while (pos != std::string::npos && pos + self.size() < all.size() &&
+           all[pos + self.size()] != ' ')
+      pos = all.find(self, pos + 1);
+
+    std::string out;
+    out.reserve(header.size() + all.size() + 2);
+    out += header;
+    if (pos == std::string::npos) {
+      out += all;
+    } else {
+      out.append(all, 0, pos);
+      out.append(all, pos + self.size(), std::string::npos);
     }
-    return out + "\r\n";
+    out += "\r\n";
+    return out;
   }
 
 private:
+  void schedule_expiry() {
+    expiry_timer.expires_after(std::chrono::seconds(60));
+    expiry_timer.async_wait([this](error_code error) {
+      if (!error) {
+        limiter.expire();
+        schedule_expiry();
+      }
+    });
+  }
+
   io::io_context &io_context;
   tcp::acceptor acceptor;
+  io::steady_timer expiry_timer;
+  rate_limiter limiter;
   std::optional<tcp::socket> socket;
   std::unordered_set<std::shared_ptr<session>> clients;
   std::unordered_map<std::string, session_ptr> online;
+  presence<session> users;
+  user_cache cache;
+  std::thread warmup;
 
   decltype(initStorage()) &db;
 };
@@ -331,6 +534,9 @@ int main() {
   auto &storage = initStorage("user.db");
   io::io_context io_context;
   server srv(io_context, 15001, storage);
+  migrateStorage("user.db");
+  openStorage(storage);
+  srv.warm_up("user.db");
   srv.async_accept();
   io_context.run();
   return 0;